@@ -0,0 +1,908 @@
+/*********************************************************************************
+* Daniel Choy
+* 2022 Spring
+* h2.c
+* Implementation file for cleartext HTTP/2 (h2c) connections
+*********************************************************************************/
+
+#include "h2.h"
+#include "hpack.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define PREFACE          "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define PREFACE_LEN      24
+#define FRAME_HEADER     9
+#define MAX_FRAME_SIZE   16384
+#define DEFAULT_WINDOW   65535
+#define MAX_WINDOW       0x7fffffff
+#define MAX_STREAMS      128
+#define MAX_HEADER_LIST  32768
+#define WRITE_HIGH_WATER (4 * MAX_FRAME_SIZE)
+#define MAX_OUTPUT       (4 * WRITE_HIGH_WATER)
+#define READ_CHUNK       (MAX_FRAME_SIZE + FRAME_HEADER)
+
+#define FRAME_DATA          0x0
+#define FRAME_HEADERS       0x1
+#define FRAME_PRIORITY      0x2
+#define FRAME_RST_STREAM    0x3
+#define FRAME_SETTINGS      0x4
+#define FRAME_PUSH_PROMISE  0x5
+#define FRAME_PING          0x6
+#define FRAME_GOAWAY        0x7
+#define FRAME_WINDOW_UPDATE 0x8
+#define FRAME_CONTINUATION  0x9
+
+#define FLAG_END_STREAM  0x1
+#define FLAG_ACK         0x1
+#define FLAG_END_HEADERS 0x4
+#define FLAG_PADDED      0x8
+#define FLAG_PRIORITY    0x20
+
+#define SETTINGS_ENABLE_PUSH            0x2
+#define SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define SETTINGS_INITIAL_WINDOW_SIZE    0x4
+#define SETTINGS_MAX_FRAME_SIZE         0x5
+#define SETTINGS_MAX_HEADER_LIST_SIZE   0x6
+
+#define NO_ERROR           0x0
+#define PROTOCOL_ERROR     0x1
+#define INTERNAL_ERROR     0x2
+#define FLOW_CONTROL_ERROR 0x3
+#define STREAM_CLOSED      0x5
+#define FRAME_SIZE_ERROR   0x6
+#define REFUSED_STREAM     0x7
+#define COMPRESSION_ERROR  0x9
+#define ENHANCE_YOUR_CALM  0xb
+
+typedef enum { STREAM_RECEIVING, STREAM_SENDING } StreamState;
+
+// A request in flight. A PUT or APPEND body is written to fd as it arrives,
+// and the response body is sent either from fd (GET) or from a canned status
+// message. status stays 0 until it is known.
+typedef struct Stream {
+    uint32_t id;
+    StreamState state;
+    char *method;
+    char *path;
+    long request_id;
+    long content_length;
+    long received;
+    int status;
+    int fd;
+    const char *message;
+    off_t remaining;
+    int64_t send_window;
+    struct Stream *next;
+} Stream;
+
+typedef struct {
+    int fd;
+    FILE *logfile;
+    uint8_t *in;
+    size_t in_len;
+    size_t in_cap;
+    uint8_t *out;
+    size_t out_len;
+    size_t out_sent;
+    size_t out_cap;
+    HpackTable table;
+    Stream *streams;
+    int num_streams;
+    uint32_t last_stream_id;
+    int64_t send_window;
+    int64_t initial_window;
+    uint8_t *header_block;
+    size_t header_len;
+    size_t header_cap;
+    uint32_t header_stream;
+    bool header_end_stream;
+    bool preface_seen;
+    bool closing;
+    bool failed;
+} Connection;
+
+// Returns true if buffer starts with the whole connection preface.
+bool h2_is_preface(const char *buffer, size_t len) {
+    return len >= PREFACE_LEN && memcmp(buffer, PREFACE, PREFACE_LEN) == 0;
+}
+
+// Returns true if buffer is shorter than the connection preface but matches
+// it so far, so more bytes are needed to tell HTTP/2 from HTTP/1.1.
+bool h2_is_partial_preface(const char *buffer, size_t len) {
+    return len < PREFACE_LEN && memcmp(buffer, PREFACE, len) == 0;
+}
+
+static void *grow(void *buffer, size_t *cap, size_t needed) {
+    if (needed > *cap) {
+        while (*cap < needed) {
+            *cap = *cap > 0 ? *cap * 2 : 4096;
+        }
+        buffer = realloc(buffer, *cap);
+    }
+    return buffer;
+}
+
+// Returns space for n more bytes at the end of the output buffer.
+static uint8_t *reserve(Connection *c, size_t n) {
+    if (c->out_len + n > c->out_cap && c->out_sent > 0) {
+        memmove(c->out, c->out + c->out_sent, c->out_len - c->out_sent);
+        c->out_len -= c->out_sent;
+        c->out_sent = 0;
+    }
+    c->out = grow(c->out, &c->out_cap, c->out_len + n);
+    return c->out + c->out_len;
+}
+
+static void write_frame_header(uint8_t *p, size_t len, uint8_t type, uint8_t flags, uint32_t id) {
+    p[0] = len >> 16;
+    p[1] = len >> 8;
+    p[2] = len;
+    p[3] = type;
+    p[4] = flags;
+    p[5] = id >> 24;
+    p[6] = id >> 16;
+    p[7] = id >> 8;
+    p[8] = id;
+}
+
+static void queue_frame(
+    Connection *c, uint8_t type, uint8_t flags, uint32_t id, const uint8_t *payload, size_t len) {
+    uint8_t *p = reserve(c, FRAME_HEADER + len);
+    write_frame_header(p, len, type, flags, id);
+    if (len > 0) {
+        memcpy(p + FRAME_HEADER, payload, len);
+    }
+    c->out_len += FRAME_HEADER + len;
+}
+
+static void queue_u32_frame(Connection *c, uint8_t type, uint32_t id, uint32_t value) {
+    uint8_t payload[4] = { value >> 24, value >> 16, value >> 8, value };
+    queue_frame(c, type, 0, id, payload, sizeof payload);
+}
+
+static void queue_goaway(Connection *c, uint32_t code) {
+    uint8_t payload[8] = { c->last_stream_id >> 24, c->last_stream_id >> 16, c->last_stream_id >> 8,
+        c->last_stream_id, code >> 24, code >> 16, code >> 8, code };
+    queue_frame(c, FRAME_GOAWAY, 0, 0, payload, sizeof payload);
+}
+
+// Sends GOAWAY and stops reading; the loop exits once output is flushed.
+static void connection_error(Connection *c, uint32_t code) {
+    if (!c->failed) {
+        queue_goaway(c, code);
+        c->failed = true;
+        c->closing = true;
+    }
+}
+
+static Stream *find_stream(Connection *c, uint32_t id) {
+    for (Stream *s = c->streams; s != NULL; s = s->next) {
+        if (s->id == id) {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+// Appends a stream to the end of the list so DATA frames go out in the order
+// the requests arrived.
+static Stream *new_stream(Connection *c, uint32_t id) {
+    Stream *s = calloc(1, sizeof(Stream));
+    Stream **tail = &c->streams;
+    s->id = id;
+    s->state = STREAM_RECEIVING;
+    s->fd = -1;
+    s->content_length = -1;
+    s->send_window = c->initial_window;
+    while (*tail != NULL) {
+        tail = &(*tail)->next;
+    }
+    *tail = s;
+    c->num_streams++;
+    return s;
+}
+
+static void remove_stream(Connection *c, Stream *s) {
+    Stream **link = &c->streams;
+    while (*link != s) {
+        link = &(*link)->next;
+    }
+    *link = s->next;
+    c->num_streams--;
+    if (s->fd >= 0) {
+        close(s->fd);
+    }
+    free(s->method);
+    free(s->path);
+    free(s);
+}
+
+static void reset_stream(Connection *c, Stream *s, uint32_t code) {
+    queue_u32_frame(c, FRAME_RST_STREAM, s->id, code);
+    remove_stream(c, s);
+}
+
+static const char *status_message(int status) {
+    switch (status) {
+    case 200: return "OK\n";
+    case 201: return "Created\n";
+    case 400: return "Bad Request\n";
+    case 403: return "Forbidden\n";
+    case 404: return "Not Found\n";
+    case 501: return "Not Implemented\n";
+    default: return "Internal Server Error\n";
+    }
+}
+
+static bool write_all(int fd, const uint8_t *buffer, size_t len) {
+    size_t written = 0;
+    while (written < len) {
+        ssize_t current = write(fd, buffer + written, len - written);
+        if (current < 0) {
+            return false;
+        }
+        written += current;
+    }
+    return true;
+}
+
+// The file handlers below follow the status codes of the HTTP/1.1 handlers in
+// httpserver.c.
+static int get_file(Stream *s) {
+    struct stat fd_stats;
+    int fd = open(s->path + 1, O_RDONLY);
+    if (fd < 0) {
+        return errno == ENOENT ? 404 : (errno == EACCES || errno == EISDIR) ? 403 : 500;
+    }
+    if (fstat(fd, &fd_stats) < 0 || S_ISDIR(fd_stats.st_mode)) {
+        close(fd);
+        return 403;
+    }
+    s->fd = fd;
+    s->remaining = fd_stats.st_size;
+    return 200;
+}
+
+// Opens the file a PUT body is written to. Returns the status the request
+// gets if the body is written out successfully.
+static int put_file(Stream *s) {
+    int status = 200;
+    int fd = open(s->path + 1, O_WRONLY | O_TRUNC);
+    if (fd < 0 && errno == ENOENT) {
+        fd = open(s->path + 1, O_WRONLY | O_CREAT | O_TRUNC, 0777);
+        chmod(s->path + 1, 0777);
+        status = 201;
+    }
+    if (fd < 0) {
+        return (errno == EACCES || errno == EISDIR) ? 403 : 500;
+    }
+    s->fd = fd;
+    return status;
+}
+
+static int append_file(Stream *s) {
+    int fd = open(s->path + 1, O_APPEND | O_WRONLY);
+    if (fd < 0) {
+        return errno == ENOENT ? 404 : (errno == EACCES || errno == EISDIR) ? 403 : 500;
+    }
+    s->fd = fd;
+    return 200;
+}
+
+// Checks a request once its headers are in. PUT and APPEND open their file
+// here so DATA frames can be written to it as they arrive; GET waits until
+// the request is complete.
+static void start_request(Stream *s) {
+    if (s->method == NULL || s->path == NULL || s->path[0] != '/'
+        || s->path[strlen(s->path) - 1] == '/') {
+        s->status = 400;
+    } else if (strcmp(s->method, "GET") == 0) {
+        s->status = 0;
+    } else if (strcmp(s->method, "PUT") == 0) {
+        s->status = put_file(s);
+    } else if (strcmp(s->method, "APPEND") == 0) {
+        s->status = append_file(s);
+    } else {
+        s->status = 501;
+    }
+}
+
+// Finishes a complete request and queues the response HEADERS. The body is
+// sent later by send_data() as flow control allows.
+static void handle_request(Connection *c, Stream *s) {
+    uint8_t block[128];
+    char value[32];
+    size_t len = 0;
+    int status;
+
+    if (s->status == 0) {
+        s->status = get_file(s);
+    } else if (s->fd >= 0) {
+        close(s->fd);
+        s->fd = -1;
+    }
+    status = s->status;
+
+    if (status != 400 && status != 501) {
+        fprintf(c->logfile, "%s,%s,%d,%ld\n", s->method, s->path, status, s->request_id);
+        fflush(c->logfile);
+    }
+    if (s->fd < 0) {
+        s->message = status_message(status);
+        s->remaining = strlen(s->message);
+    }
+
+    snprintf(value, sizeof value, "%d", status);
+    len += hpack_encode(block + len, ":status", value);
+    snprintf(value, sizeof value, "%jd", (intmax_t) s->remaining);
+    len += hpack_encode(block + len, "content-length", value);
+
+    if (s->remaining == 0) {
+        queue_frame(c, FRAME_HEADERS, FLAG_END_HEADERS | FLAG_END_STREAM, s->id, block, len);
+        remove_stream(c, s);
+        return;
+    }
+    queue_frame(c, FRAME_HEADERS, FLAG_END_HEADERS, s->id, block, len);
+    s->state = STREAM_SENDING;
+}
+
+static void on_header(
+    void *ctx, const char *name, size_t name_len, const char *value, size_t value_len) {
+    Stream *s = (Stream *) ctx;
+    if (s == NULL) {
+        return;
+    }
+    if (name_len == 7 && memcmp(name, ":method", 7) == 0) {
+        free(s->method);
+        s->method = strndup(value, value_len);
+    } else if (name_len == 5 && memcmp(name, ":path", 5) == 0) {
+        free(s->path);
+        s->path = strndup(value, value_len);
+    } else if (name_len == 10 && memcmp(name, "request-id", 10) == 0) {
+        char *id = strndup(value, value_len);
+        s->request_id = atol(id);
+        free(id);
+    } else if (name_len == 14 && memcmp(name, "content-length", 14) == 0) {
+        char *length = strndup(value, value_len);
+        s->content_length = atol(length);
+        free(length);
+    }
+}
+
+// Decodes the header block collected from HEADERS and CONTINUATION frames.
+// Refused streams and trailers are still decoded to keep the HPACK table in
+// sync with the client.
+static void end_headers(Connection *c) {
+    uint32_t id = c->header_stream;
+    bool end_stream = c->header_end_stream;
+    bool is_new = id > c->last_stream_id;
+    Stream *s = find_stream(c, id);
+    Stream *target = NULL;
+    bool ok;
+
+    if (is_new) {
+        c->last_stream_id = id;
+        if (!c->closing && c->num_streams < MAX_STREAMS) {
+            s = target = new_stream(c, id);
+        }
+    }
+    ok = hpack_decode(&c->table, c->header_block, c->header_len, on_header, target);
+    c->header_stream = 0;
+    c->header_len = 0;
+
+    if (!ok) {
+        connection_error(c, COMPRESSION_ERROR);
+    } else if (is_new && target == NULL) {
+        queue_u32_frame(c, FRAME_RST_STREAM, id, REFUSED_STREAM);
+    } else if (s == NULL) {
+        queue_u32_frame(c, FRAME_RST_STREAM, id, STREAM_CLOSED);
+    } else if (!is_new && (s->state != STREAM_RECEIVING || !end_stream)) {
+        connection_error(c, PROTOCOL_ERROR);
+    } else {
+        if (is_new) {
+            start_request(s);
+        }
+        if (end_stream) {
+            handle_request(c, s);
+        }
+    }
+}
+
+// Collects a fragment of a header block. A block that grows past
+// MAX_HEADER_LIST, such as a flood of CONTINUATION frames, is a connection
+// error since the rest of it can no longer be decoded.
+static void append_header_block(Connection *c, const uint8_t *p, size_t len) {
+    if (c->header_len + len > MAX_HEADER_LIST) {
+        connection_error(c, ENHANCE_YOUR_CALM);
+        return;
+    }
+    c->header_block = grow(c->header_block, &c->header_cap, c->header_len + len);
+    memcpy(c->header_block + c->header_len, p, len);
+    c->header_len += len;
+}
+
+// Removes the pad length byte and padding of a PADDED frame.
+static bool strip_padding(uint8_t flags, const uint8_t **p, size_t *len) {
+    if (flags & FLAG_PADDED) {
+        if (*len < 1 || (*p)[0] >= *len) {
+            return false;
+        }
+        *len -= 1 + (*p)[0];
+        *p += 1;
+    }
+    return true;
+}
+
+static void on_headers(Connection *c, uint8_t flags, uint32_t id, const uint8_t *p, size_t len) {
+    if (id == 0 || id % 2 == 0 || !strip_padding(flags, &p, &len)) {
+        connection_error(c, PROTOCOL_ERROR);
+        return;
+    }
+    if (flags & FLAG_PRIORITY) {
+        if (len < 5) {
+            connection_error(c, FRAME_SIZE_ERROR);
+            return;
+        }
+        p += 5;
+        len -= 5;
+    }
+    c->header_stream = id;
+    c->header_end_stream = (flags & FLAG_END_STREAM) != 0;
+    append_header_block(c, p, len);
+    if (!c->failed && (flags & FLAG_END_HEADERS)) {
+        end_headers(c);
+    }
+}
+
+static void on_data(Connection *c, uint8_t flags, uint32_t id, const uint8_t *p, size_t len) {
+    size_t frame_len = len;
+    Stream *s;
+
+    if (id == 0 || !strip_padding(flags, &p, &len)) {
+        connection_error(c, PROTOCOL_ERROR);
+        return;
+    }
+    // Bodies are written to their file before this returns, so handing the
+    // windows back never lets a client have more than a window buffered here
+    if (frame_len > 0) {
+        queue_u32_frame(c, FRAME_WINDOW_UPDATE, 0, frame_len);
+    }
+    s = find_stream(c, id);
+    if (s == NULL || s->state != STREAM_RECEIVING) {
+        if (id > c->last_stream_id) {
+            connection_error(c, PROTOCOL_ERROR);
+        } else {
+            queue_u32_frame(c, FRAME_RST_STREAM, id, STREAM_CLOSED);
+        }
+        return;
+    }
+
+    s->received += len;
+    if (s->content_length >= 0
+        && (s->received > s->content_length
+            || ((flags & FLAG_END_STREAM) && s->received != s->content_length))) {
+        reset_stream(c, s, PROTOCOL_ERROR);
+    } else {
+        if (s->fd >= 0 && !write_all(s->fd, p, len)) {
+            close(s->fd);
+            s->fd = -1;
+            s->status = 500;
+        }
+        if (flags & FLAG_END_STREAM) {
+            handle_request(c, s);
+        } else if (frame_len > 0) {
+            queue_u32_frame(c, FRAME_WINDOW_UPDATE, id, frame_len);
+        }
+    }
+}
+
+// Applies a SETTINGS payload from a SETTINGS frame or an HTTP2-Settings
+// header. Returns an error code, or NO_ERROR.
+static uint32_t apply_settings(Connection *c, const uint8_t *p, size_t len) {
+    for (size_t i = 0; i + 6 <= len; i += 6) {
+        uint16_t id = (p[i] << 8) | p[i + 1];
+        uint32_t value = ((uint32_t) p[i + 2] << 24) | (p[i + 3] << 16) | (p[i + 4] << 8) | p[i + 5];
+
+        if (id == SETTINGS_INITIAL_WINDOW_SIZE) {
+            if (value > MAX_WINDOW) {
+                return FLOW_CONTROL_ERROR;
+            }
+            for (Stream *s = c->streams; s != NULL; s = s->next) {
+                s->send_window += (int64_t) value - c->initial_window;
+            }
+            c->initial_window = value;
+        } else if (id == SETTINGS_MAX_FRAME_SIZE) {
+            // Frames are never larger than the 16384 byte minimum anyway
+            if (value < MAX_FRAME_SIZE || value > 0xffffff) {
+                return PROTOCOL_ERROR;
+            }
+        } else if (id == SETTINGS_ENABLE_PUSH && value > 1) {
+            return PROTOCOL_ERROR;
+        }
+    }
+    return NO_ERROR;
+}
+
+static void on_settings(Connection *c, uint8_t flags, uint32_t id, const uint8_t *p, size_t len) {
+    uint32_t code;
+    if (id != 0) {
+        connection_error(c, PROTOCOL_ERROR);
+    } else if (flags & FLAG_ACK) {
+        if (len != 0) {
+            connection_error(c, FRAME_SIZE_ERROR);
+        }
+    } else if (len % 6 != 0) {
+        connection_error(c, FRAME_SIZE_ERROR);
+    } else if ((code = apply_settings(c, p, len)) != NO_ERROR) {
+        connection_error(c, code);
+    } else {
+        queue_frame(c, FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0);
+    }
+}
+
+static void on_window_update(Connection *c, uint32_t id, const uint8_t *p, size_t len) {
+    uint32_t increment;
+    Stream *s;
+
+    if (len != 4) {
+        connection_error(c, FRAME_SIZE_ERROR);
+        return;
+    }
+    increment = (((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]) & MAX_WINDOW;
+    if (id == 0) {
+        c->send_window += increment;
+        if (increment == 0) {
+            connection_error(c, PROTOCOL_ERROR);
+        } else if (c->send_window > MAX_WINDOW) {
+            connection_error(c, FLOW_CONTROL_ERROR);
+        }
+    } else if ((s = find_stream(c, id)) != NULL) {
+        s->send_window += increment;
+        if (increment == 0) {
+            reset_stream(c, s, PROTOCOL_ERROR);
+        } else if (s->send_window > MAX_WINDOW) {
+            reset_stream(c, s, FLOW_CONTROL_ERROR);
+        }
+    }
+}
+
+static void handle_frame(
+    Connection *c, uint8_t type, uint8_t flags, uint32_t id, const uint8_t *p, size_t len) {
+    Stream *s;
+
+    // A header block must be finished before any other frame
+    if (c->header_stream != 0 && (type != FRAME_CONTINUATION || id != c->header_stream)) {
+        connection_error(c, PROTOCOL_ERROR);
+        return;
+    }
+
+    switch (type) {
+    case FRAME_DATA: on_data(c, flags, id, p, len); break;
+    case FRAME_HEADERS: on_headers(c, flags, id, p, len); break;
+    case FRAME_PRIORITY:
+        if (id == 0) {
+            connection_error(c, PROTOCOL_ERROR);
+        }
+        break;
+    case FRAME_RST_STREAM:
+        if (id == 0 || len != 4) {
+            connection_error(c, id == 0 ? PROTOCOL_ERROR : FRAME_SIZE_ERROR);
+        } else if ((s = find_stream(c, id)) != NULL) {
+            remove_stream(c, s);
+        }
+        break;
+    case FRAME_SETTINGS: on_settings(c, flags, id, p, len); break;
+    case FRAME_PUSH_PROMISE: connection_error(c, PROTOCOL_ERROR); break;
+    case FRAME_PING:
+        if (id != 0 || len != 8) {
+            connection_error(c, id != 0 ? PROTOCOL_ERROR : FRAME_SIZE_ERROR);
+        } else if ((flags & FLAG_ACK) == 0) {
+            queue_frame(c, FRAME_PING, FLAG_ACK, 0, p, len);
+        }
+        break;
+    case FRAME_GOAWAY: c->closing = true; break;
+    case FRAME_WINDOW_UPDATE: on_window_update(c, id, p, len); break;
+    case FRAME_CONTINUATION:
+        if (c->header_stream == 0) {
+            connection_error(c, PROTOCOL_ERROR);
+            break;
+        }
+        append_header_block(c, p, len);
+        if (!c->failed && (flags & FLAG_END_HEADERS)) {
+            end_headers(c);
+        }
+        break;
+    default: break;
+    }
+}
+
+// Handles every complete frame in the input buffer.
+static void process_input(Connection *c) {
+    size_t pos = 0;
+
+    if (!c->preface_seen) {
+        if (h2_is_partial_preface((char *) c->in, c->in_len)) {
+            return;
+        } else if (!h2_is_preface((char *) c->in, c->in_len)) {
+            connection_error(c, PROTOCOL_ERROR);
+            return;
+        }
+        c->preface_seen = true;
+        pos = PREFACE_LEN;
+    }
+
+    while (!c->failed && c->in_len - pos >= FRAME_HEADER) {
+        uint8_t *p = c->in + pos;
+        size_t len = (p[0] << 16) | (p[1] << 8) | p[2];
+        uint32_t id = (((uint32_t) p[5] << 24) | (p[6] << 16) | (p[7] << 8) | p[8]) & MAX_WINDOW;
+
+        // A client that floods PINGs and the like without reading the replies
+        if (c->out_len - c->out_sent > MAX_OUTPUT) {
+            connection_error(c, ENHANCE_YOUR_CALM);
+            break;
+        }
+        if (len > MAX_FRAME_SIZE) {
+            connection_error(c, FRAME_SIZE_ERROR);
+            break;
+        }
+        if (c->in_len - pos < FRAME_HEADER + len) {
+            break;
+        }
+        handle_frame(c, p[3], p[4], id, p + FRAME_HEADER, len);
+        pos += FRAME_HEADER + len;
+    }
+
+    memmove(c->in, c->in + pos, c->in_len - pos);
+    c->in_len -= pos;
+}
+
+// Queues the next DATA frame of a stream. Returns false if nothing was sent.
+static bool send_data_frame(Connection *c, Stream *s) {
+    int64_t n = MAX_FRAME_SIZE;
+    ssize_t current;
+    uint8_t *p;
+
+    n = s->remaining < n ? s->remaining : n;
+    n = s->send_window < n ? s->send_window : n;
+    n = c->send_window < n ? c->send_window : n;
+    if (n <= 0) {
+        return false;
+    }
+
+    p = reserve(c, FRAME_HEADER + n);
+    if (s->fd >= 0) {
+        current = read(s->fd, p + FRAME_HEADER, n);
+    } else {
+        memcpy(p + FRAME_HEADER, s->message + strlen(s->message) - s->remaining, n);
+        current = n;
+    }
+    if (current <= 0) {
+        reset_stream(c, s, INTERNAL_ERROR);
+        return false;
+    }
+
+    s->remaining -= current;
+    s->send_window -= current;
+    c->send_window -= current;
+    write_frame_header(p, current, FRAME_DATA, s->remaining == 0 ? FLAG_END_STREAM : 0, s->id);
+    c->out_len += FRAME_HEADER + current;
+    if (s->remaining == 0) {
+        remove_stream(c, s);
+    }
+    return true;
+}
+
+// Interleaves response bodies one frame per stream per round, so a large or
+// slow file does not hold up the small ones behind it. After an upgrade the
+// body of stream 1 waits for the client preface, since some clients cannot
+// buffer much data behind the 101 response.
+static void send_data(Connection *c) {
+    bool progress = c->preface_seen;
+    while (progress && c->out_len - c->out_sent < WRITE_HIGH_WATER && c->send_window > 0) {
+        Stream *s = c->streams;
+        progress = false;
+        while (s != NULL && c->send_window > 0) {
+            Stream *next = s->next;
+            if (s->state == STREAM_SENDING && send_data_frame(c, s)) {
+                progress = true;
+            }
+            s = next;
+        }
+    }
+}
+
+// Returns true if some stream has a response body the windows allow sending.
+static bool can_send_data(Connection *c) {
+    if (!c->preface_seen || c->send_window <= 0) {
+        return false;
+    }
+    for (Stream *s = c->streams; s != NULL; s = s->next) {
+        if (s->state == STREAM_SENDING && s->send_window > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool flush_output(Connection *c) {
+    while (c->out_sent < c->out_len) {
+        ssize_t current
+            = send(c->fd, c->out + c->out_sent, c->out_len - c->out_sent, MSG_DONTWAIT);
+        if (current < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            } else if (errno != EINTR) {
+                return false;
+            }
+            continue;
+        }
+        c->out_sent += current;
+    }
+    if (c->out_sent == c->out_len) {
+        c->out_sent = 0;
+        c->out_len = 0;
+    }
+    return true;
+}
+
+static bool read_input(Connection *c) {
+    ssize_t current;
+    c->in = grow(c->in, &c->in_cap, c->in_len + READ_CHUNK);
+    current = recv(c->fd, c->in + c->in_len, c->in_cap - c->in_len, MSG_DONTWAIT);
+    if (current == 0) {
+        return false;
+    } else if (current < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    }
+    c->in_len += current;
+    process_input(c);
+    return true;
+}
+
+// Decodes the base64url HTTP2-Settings header value into out.
+static size_t base64url_decode(const char *in, uint8_t *out) {
+    uint32_t bits = 0;
+    int num_bits = 0;
+    size_t n = 0;
+
+    for (; *in != '\0' && *in != '='; in++) {
+        int v;
+        if (*in >= 'A' && *in <= 'Z') {
+            v = *in - 'A';
+        } else if (*in >= 'a' && *in <= 'z') {
+            v = *in - 'a' + 26;
+        } else if (*in >= '0' && *in <= '9') {
+            v = *in - '0' + 52;
+        } else if (*in == '-' || *in == '+') {
+            v = 62;
+        } else if (*in == '_' || *in == '/') {
+            v = 63;
+        } else {
+            continue;
+        }
+        bits = (bits << 6) | v;
+        num_bits += 6;
+        if (num_bits >= 8) {
+            num_bits -= 8;
+            out[n++] = bits >> num_bits;
+        }
+    }
+    return n;
+}
+
+// Serves an HTTP/2 connection until the client closes it or a connection
+// error occurs. preread holds bytes already received from connfd. Once drainfd
+// becomes readable the client is sent GOAWAY and the streams already open are
+// finished. connfd is left open for the caller to close.
+void h2_serve(int connfd, FILE *logfile, int drainfd, const char *preread, size_t preread_len,
+    const H2Upgrade *upgrade) {
+    Connection conn;
+    Connection *c = &conn;
+    uint8_t settings[12] = { 0, SETTINGS_MAX_CONCURRENT_STREAMS, 0, 0, 0, MAX_STREAMS, 0,
+        SETTINGS_MAX_HEADER_LIST_SIZE, MAX_HEADER_LIST >> 24, MAX_HEADER_LIST >> 16,
+        MAX_HEADER_LIST >> 8, MAX_HEADER_LIST & 0xff };
+
+    memset(c, 0, sizeof conn);
+    c->fd = connfd;
+    c->logfile = logfile;
+    c->table = new_hpack_table(HPACK_DEFAULT_TABLE_SIZE);
+    c->send_window = DEFAULT_WINDOW;
+    c->initial_window = DEFAULT_WINDOW;
+
+    if (upgrade != NULL) {
+        const char *response
+            = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+        memcpy(reserve(c, strlen(response)), response, strlen(response));
+        c->out_len += strlen(response);
+    }
+    queue_frame(c, FRAME_SETTINGS, 0, 0, settings, sizeof settings);
+
+    if (upgrade != NULL) {
+        uint8_t *payload = malloc(strlen(upgrade->settings) + 1);
+        size_t len = base64url_decode(upgrade->settings, payload);
+        uint32_t code = len % 6 == 0 ? apply_settings(c, payload, len) : FRAME_SIZE_ERROR;
+        free(payload);
+
+        if (code != NO_ERROR) {
+            connection_error(c, code);
+        } else {
+            Stream *s = new_stream(c, 1);
+            s->method = strdup("GET");
+            s->path = strdup(upgrade->uri);
+            s->request_id = upgrade->request_id;
+            c->last_stream_id = 1;
+            start_request(s);
+            handle_request(c, s);
+        }
+    }
+
+    if (preread_len > 0) {
+        c->in = grow(c->in, &c->in_cap, preread_len);
+        memcpy(c->in, preread, preread_len);
+        c->in_len = preread_len;
+        process_input(c);
+    }
+
+    for (;;) {
+        struct pollfd fds[2];
+        bool pending;
+        bool reading;
+
+        send_data(c);
+        if (!flush_output(c)) {
+            break;
+        }
+        pending = c->out_len > c->out_sent;
+        if (!pending && (c->failed || (c->closing && c->streams == NULL))) {
+            break;
+        }
+        // The client is not reading the GOAWAY queued behind its backlog
+        if (c->failed && c->out_len - c->out_sent > MAX_OUTPUT) {
+            break;
+        }
+
+        // Waiting for POLLOUT when only more DATA is ready lets incoming frames
+        // be handled between bursts of output. Input is left unread while the
+        // client is not reading its replies, so they cannot pile up.
+        reading = !c->failed && c->out_len - c->out_sent <= WRITE_HIGH_WATER;
+        fds[0].fd = connfd;
+        fds[0].events = (reading ? POLLIN : 0) | (pending || can_send_data(c) ? POLLOUT : 0);
+        fds[0].revents = 0;
+        fds[1].fd = drainfd;
+        fds[1].events = POLLIN;
+        fds[1].revents = 0;
+        if (poll(fds, c->closing ? 1 : 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (!c->closing && (fds[1].revents & POLLIN)) {
+            queue_goaway(c, NO_ERROR);
+            c->closing = true;
+        }
+        if ((fds[0].revents & (POLLIN | POLLHUP | POLLERR)) && reading && !read_input(c)) {
+            break;
+        }
+        if ((fds[0].revents & (POLLHUP | POLLERR)) && c->failed) {
+            break;
+        }
+    }
+
+    while (c->streams != NULL) {
+        remove_stream(c, c->streams);
+    }
+    free_hpack_table(&c->table);
+    free(c->in);
+    free(c->out);
+    free(c->header_block);
+}
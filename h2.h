@@ -0,0 +1,27 @@
+/*********************************************************************************
+* Daniel Choy
+* 2022 Spring
+* h2.h
+* Header file for cleartext HTTP/2 (h2c) connections
+*********************************************************************************/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+// The HTTP/1.1 GET request a connection upgraded from with "Upgrade: h2c".
+// It becomes stream 1 of the HTTP/2 connection.
+typedef struct {
+    const char *uri;
+    long request_id;
+    const char *settings;
+} H2Upgrade;
+
+bool h2_is_preface(const char *buffer, size_t len);
+
+bool h2_is_partial_preface(const char *buffer, size_t len);
+
+void h2_serve(int connfd, FILE *logfile, int drainfd, const char *preread, size_t preread_len,
+    const H2Upgrade *upgrade);
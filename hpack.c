@@ -0,0 +1,442 @@
+/*********************************************************************************
+* Daniel Choy
+* 2022 Spring
+* hpack.c
+* Implementation file for HPACK header compression ADT
+*********************************************************************************/
+
+#include "hpack.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define STATIC_TABLE_LEN  61
+#define HUFFMAN_SYMBOLS   257
+#define HUFFMAN_EOS       256
+#define ENTRY_OVERHEAD    32
+
+static const char *static_table[STATIC_TABLE_LEN][2] = {
+    { ":authority", "" },
+    { ":method", "GET" },
+    { ":method", "POST" },
+    { ":path", "/" },
+    { ":path", "/index.html" },
+    { ":scheme", "http" },
+    { ":scheme", "https" },
+    { ":status", "200" },
+    { ":status", "204" },
+    { ":status", "206" },
+    { ":status", "304" },
+    { ":status", "400" },
+    { ":status", "404" },
+    { ":status", "500" },
+    { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" },
+    { "accept-ranges", "" },
+    { "accept", "" },
+    { "access-control-allow-origin", "" },
+    { "age", "" },
+    { "allow", "" },
+    { "authorization", "" },
+    { "cache-control", "" },
+    { "content-disposition", "" },
+    { "content-encoding", "" },
+    { "content-language", "" },
+    { "content-length", "" },
+    { "content-location", "" },
+    { "content-range", "" },
+    { "content-type", "" },
+    { "cookie", "" },
+    { "date", "" },
+    { "etag", "" },
+    { "expect", "" },
+    { "expires", "" },
+    { "from", "" },
+    { "host", "" },
+    { "if-match", "" },
+    { "if-modified-since", "" },
+    { "if-none-match", "" },
+    { "if-range", "" },
+    { "if-unmodified-since", "" },
+    { "last-modified", "" },
+    { "link", "" },
+    { "location", "" },
+    { "max-forwards", "" },
+    { "proxy-authenticate", "" },
+    { "proxy-authorization", "" },
+    { "range", "" },
+    { "referer", "" },
+    { "refresh", "" },
+    { "retry-after", "" },
+    { "server", "" },
+    { "set-cookie", "" },
+    { "strict-transport-security", "" },
+    { "transfer-encoding", "" },
+    { "user-agent", "" },
+    { "vary", "" },
+    { "via", "" },
+    { "www-authenticate", "" },
+};
+
+// Huffman code and its length in bits for every symbol (RFC 7541 Appendix B)
+static const struct {
+    uint32_t code;
+    uint8_t bits;
+} huffman_codes[HUFFMAN_SYMBOLS] = {
+    {0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28},
+    {0xfffffe4, 28}, {0xfffffe5, 28}, {0xfffffe6, 28}, {0xfffffe7, 28},
+    {0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28},
+    {0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28},
+    {0xfffffed, 28}, {0xfffffee, 28}, {0xfffffef, 28}, {0xffffff0, 28},
+    {0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+    {0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28},
+    {0xffffff8, 28}, {0xffffff9, 28}, {0xffffffa, 28}, {0xffffffb, 28},
+    {0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12},
+    {0x1ff9, 13}, {0x15, 6}, {0xf8, 8}, {0x7fa, 11},
+    {0x3fa, 10}, {0x3fb, 10}, {0xf9, 8}, {0x7fb, 11},
+    {0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6},
+    {0x0, 5}, {0x1, 5}, {0x2, 5}, {0x19, 6},
+    {0x1a, 6}, {0x1b, 6}, {0x1c, 6}, {0x1d, 6},
+    {0x1e, 6}, {0x1f, 6}, {0x5c, 7}, {0xfb, 8},
+    {0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10},
+    {0x1ffa, 13}, {0x21, 6}, {0x5d, 7}, {0x5e, 7},
+    {0x5f, 7}, {0x60, 7}, {0x61, 7}, {0x62, 7},
+    {0x63, 7}, {0x64, 7}, {0x65, 7}, {0x66, 7},
+    {0x67, 7}, {0x68, 7}, {0x69, 7}, {0x6a, 7},
+    {0x6b, 7}, {0x6c, 7}, {0x6d, 7}, {0x6e, 7},
+    {0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7},
+    {0xfc, 8}, {0x73, 7}, {0xfd, 8}, {0x1ffb, 13},
+    {0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6},
+    {0x7ffd, 15}, {0x3, 5}, {0x23, 6}, {0x4, 5},
+    {0x24, 6}, {0x5, 5}, {0x25, 6}, {0x26, 6},
+    {0x27, 6}, {0x6, 5}, {0x74, 7}, {0x75, 7},
+    {0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5},
+    {0x2b, 6}, {0x76, 7}, {0x2c, 6}, {0x8, 5},
+    {0x9, 5}, {0x2d, 6}, {0x77, 7}, {0x78, 7},
+    {0x79, 7}, {0x7a, 7}, {0x7b, 7}, {0x7ffe, 15},
+    {0x7fc, 11}, {0x3ffd, 14}, {0x1ffd, 13}, {0xffffffc, 28},
+    {0xfffe6, 20}, {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20},
+    {0x3fffd3, 22}, {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23},
+    {0x3fffd6, 22}, {0x7fffda, 23}, {0x7fffdb, 23}, {0x7fffdc, 23},
+    {0x7fffdd, 23}, {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23},
+    {0xffffec, 24}, {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23},
+    {0xffffee, 24}, {0x7fffe1, 23}, {0x7fffe2, 23}, {0x7fffe3, 23},
+    {0x7fffe4, 23}, {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23},
+    {0x3fffd9, 22}, {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24},
+    {0x3fffda, 22}, {0x1fffdd, 21}, {0xfffe9, 20}, {0x3fffdb, 22},
+    {0x3fffdc, 22}, {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21},
+    {0x7fffea, 23}, {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24},
+    {0x1fffdf, 21}, {0x3fffdf, 22}, {0x7fffeb, 23}, {0x7fffec, 23},
+    {0x1fffe0, 21}, {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21},
+    {0x7fffed, 23}, {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23},
+    {0xfffea, 20}, {0x3fffe2, 22}, {0x3fffe3, 22}, {0x3fffe4, 22},
+    {0x7ffff0, 23}, {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23},
+    {0x3ffffe0, 26}, {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19},
+    {0x3fffe7, 22}, {0x7ffff2, 23}, {0x3fffe8, 22}, {0x1ffffec, 25},
+    {0x3ffffe2, 26}, {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27},
+    {0x7ffffdf, 27}, {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25},
+    {0x7fff2, 19}, {0x1fffe3, 21}, {0x3ffffe6, 26}, {0x7ffffe0, 27},
+    {0x7ffffe1, 27}, {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24},
+    {0x1fffe4, 21}, {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26},
+    {0xffffffd, 28}, {0x7ffffe3, 27}, {0x7ffffe4, 27}, {0x7ffffe5, 27},
+    {0xfffec, 20}, {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21},
+    {0x3fffe9, 22}, {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23},
+    {0x3fffea, 22}, {0x3fffeb, 22}, {0x1ffffee, 25}, {0x1ffffef, 25},
+    {0xfffff4, 24}, {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23},
+    {0x3ffffeb, 26}, {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26},
+    {0x7ffffe7, 27}, {0x7ffffe8, 27}, {0x7ffffe9, 27}, {0x7ffffea, 27},
+    {0x7ffffeb, 27}, {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27},
+    {0x7ffffee, 27}, {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26},
+    {0x3fffffff, 30},
+};
+
+// Decoding tree built from huffman_codes. A positive child is the index of
+// the next node, a negative child -(symbol + 1) is a leaf and 0 is unused.
+static int16_t huffman_tree[HUFFMAN_SYMBOLS][2];
+static pthread_once_t huffman_once = PTHREAD_ONCE_INIT;
+
+static void build_huffman_tree(void) {
+    int nodes = 1;
+    for (int sym = 0; sym < HUFFMAN_SYMBOLS; sym++) {
+        int node = 0;
+        for (int i = huffman_codes[sym].bits - 1; i > 0; i--) {
+            int bit = (huffman_codes[sym].code >> i) & 1;
+            if (huffman_tree[node][bit] == 0) {
+                huffman_tree[node][bit] = nodes++;
+            }
+            node = huffman_tree[node][bit];
+        }
+        huffman_tree[node][huffman_codes[sym].code & 1] = -(sym + 1);
+    }
+}
+
+// Decodes a Huffman encoded string into out, which must hold len * 8 / 5 bytes.
+// Returns the decoded length or -1 if the string is malformed.
+static long huffman_decode(const uint8_t *in, size_t len, char *out) {
+    long n = 0;
+    int node = 0;
+    int pad_bits = 0;
+    bool pad_ones = true;
+
+    pthread_once(&huffman_once, build_huffman_tree);
+    for (size_t i = 0; i < len; i++) {
+        for (int b = 7; b >= 0; b--) {
+            int bit = (in[i] >> b) & 1;
+            int next = huffman_tree[node][bit];
+            pad_bits++;
+            pad_ones = pad_ones && bit;
+            if (next == 0) {
+                return -1;
+            } else if (next < 0) {
+                if (-next - 1 == HUFFMAN_EOS) {
+                    return -1;
+                }
+                out[n++] = (char) (-next - 1);
+                node = 0;
+                pad_bits = 0;
+                pad_ones = true;
+            } else {
+                node = next;
+            }
+        }
+    }
+    // Leftover bits must be a prefix of EOS no longer than 7 bits
+    if (pad_bits > 7 || !pad_ones) {
+        return -1;
+    }
+    return n;
+}
+
+HpackTable new_hpack_table(size_t max_size) {
+    HpackTable t;
+    t.capacity = max_size / ENTRY_OVERHEAD + 1;
+    t.entries = calloc(t.capacity, sizeof(HpackEntry));
+    t.count = 0;
+    t.first = 0;
+    t.size = 0;
+    t.max_size = max_size;
+    t.settings_max_size = max_size;
+    return t;
+}
+
+static void evict_entry(HpackTable *t) {
+    HpackEntry *e = &t->entries[(t->first + t->count - 1) % t->capacity];
+    t->size -= e->name_len + e->value_len + ENTRY_OVERHEAD;
+    free(e->name);
+    free(e->value);
+    t->count--;
+}
+
+static void resize_table(HpackTable *t, size_t max_size) {
+    t->max_size = max_size;
+    while (t->size > t->max_size) {
+        evict_entry(t);
+    }
+}
+
+void free_hpack_table(HpackTable *t) {
+    resize_table(t, 0);
+    free(t->entries);
+    t->entries = NULL;
+}
+
+// Takes ownership of name and value.
+static void add_entry(HpackTable *t, char *name, size_t name_len, char *value, size_t value_len) {
+    size_t size = name_len + value_len + ENTRY_OVERHEAD;
+    while (t->count > 0 && t->size + size > t->max_size) {
+        evict_entry(t);
+    }
+    if (size > t->max_size) {
+        free(name);
+        free(value);
+        return;
+    }
+    t->first = (t->first - 1 + t->capacity) % t->capacity;
+    t->entries[t->first] = (HpackEntry) { name, name_len, value, value_len };
+    t->size += size;
+    t->count++;
+}
+
+// Looks up a 1-based index in the static table followed by the dynamic table.
+static bool lookup(HpackTable *t, uint64_t index, const char **name, size_t *name_len,
+    const char **value, size_t *value_len) {
+    if (index == 0) {
+        return false;
+    } else if (index <= STATIC_TABLE_LEN) {
+        *name = static_table[index - 1][0];
+        *name_len = strlen(*name);
+        *value = static_table[index - 1][1];
+        *value_len = strlen(*value);
+        return true;
+    } else if (index - STATIC_TABLE_LEN <= (uint64_t) t->count) {
+        HpackEntry *e = &t->entries[(t->first + index - STATIC_TABLE_LEN - 1) % t->capacity];
+        *name = e->name;
+        *name_len = e->name_len;
+        *value = e->value;
+        *value_len = e->value_len;
+        return true;
+    }
+    return false;
+}
+
+// Reads an integer with an N-bit prefix. Returns false on truncated input.
+static bool decode_int(const uint8_t **p, const uint8_t *end, int prefix, uint64_t *out) {
+    uint64_t max = (1 << prefix) - 1;
+    uint64_t v;
+    int shift = 0;
+
+    if (*p >= end) {
+        return false;
+    }
+    v = *(*p)++ & max;
+    if (v < max) {
+        *out = v;
+        return true;
+    }
+    while (*p < end) {
+        uint8_t byte = *(*p)++;
+        if (shift > 56) {
+            return false;
+        }
+        v += (uint64_t) (byte & 0x7f) << shift;
+        shift += 7;
+        if ((byte & 0x80) == 0) {
+            *out = v;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Reads a string literal into a newly allocated NUL terminated buffer.
+static char *decode_string(const uint8_t **p, const uint8_t *end, size_t *len) {
+    bool huffman;
+    uint64_t n;
+    char *s;
+
+    if (*p >= end) {
+        return NULL;
+    }
+    huffman = (**p & 0x80) != 0;
+    if (!decode_int(p, end, 7, &n) || n > (uint64_t) (end - *p)) {
+        return NULL;
+    }
+    if (huffman) {
+        s = malloc(n * 8 / 5 + 1);
+        long decoded = huffman_decode(*p, n, s);
+        if (decoded < 0) {
+            free(s);
+            return NULL;
+        }
+        *len = decoded;
+    } else {
+        s = malloc(n + 1);
+        memcpy(s, *p, n);
+        *len = n;
+    }
+    s[*len] = '\0';
+    *p += n;
+    return s;
+}
+
+// Decodes a complete header block, calling emit for every header field in
+// order. Returns false on a compression error, after which the table must
+// not be used again.
+bool hpack_decode(HpackTable *t, const uint8_t *block, size_t len, HpackEmit emit, void *ctx) {
+    const uint8_t *p = block;
+    const uint8_t *end = block + len;
+    const char *name;
+    const char *value;
+    size_t name_len;
+    size_t value_len;
+    uint64_t index;
+    bool fields_seen = false;
+
+    while (p < end) {
+        if (*p & 0x80) {
+            // Indexed header field
+            if (!decode_int(&p, end, 7, &index)
+                || !lookup(t, index, &name, &name_len, &value, &value_len)) {
+                return false;
+            }
+            emit(ctx, name, name_len, value, value_len);
+            fields_seen = true;
+        } else if ((*p & 0xe0) == 0x20) {
+            // Dynamic table size update, only allowed before the first field
+            if (fields_seen || !decode_int(&p, end, 5, &index) || index > t->settings_max_size) {
+                return false;
+            }
+            resize_table(t, index);
+        } else {
+            // Literal header field with incremental indexing, without indexing or never indexed
+            bool indexing = (*p & 0xc0) == 0x40;
+            char *lit_name;
+            char *lit_value;
+
+            if (!decode_int(&p, end, indexing ? 6 : 4, &index)) {
+                return false;
+            }
+            if (index == 0) {
+                lit_name = decode_string(&p, end, &name_len);
+            } else if (lookup(t, index, &name, &name_len, &value, &value_len)) {
+                // Copied because adding the new entry may evict the one named
+                lit_name = malloc(name_len + 1);
+                memcpy(lit_name, name, name_len);
+                lit_name[name_len] = '\0';
+            } else {
+                return false;
+            }
+            if (lit_name == NULL) {
+                return false;
+            }
+            lit_value = decode_string(&p, end, &value_len);
+            if (lit_value == NULL) {
+                free(lit_name);
+                return false;
+            }
+            emit(ctx, lit_name, name_len, lit_value, value_len);
+            if (indexing) {
+                add_entry(t, lit_name, name_len, lit_value, value_len);
+            } else {
+                free(lit_name);
+                free(lit_value);
+            }
+            fields_seen = true;
+        }
+    }
+    return true;
+}
+
+// Encodes a header field as a literal without indexing, reusing a static
+// table name when there is one. name and value must be shorter than 127 bytes
+// and out must hold strlen(name) + strlen(value) + 4 bytes. Returns the number
+// of bytes written.
+size_t hpack_encode(uint8_t *out, const char *name, const char *value) {
+    size_t n = 0;
+    size_t name_len = strlen(name);
+    size_t value_len = strlen(value);
+    int index = 0;
+
+    for (int i = 0; i < STATIC_TABLE_LEN; i++) {
+        if (strcmp(static_table[i][0], name) == 0) {
+            index = i + 1;
+            break;
+        }
+    }
+
+    if (index > 0 && index < 15) {
+        out[n++] = index;
+    } else if (index > 0) {
+        out[n++] = 0x0f;
+        out[n++] = index - 15;
+    } else {
+        out[n++] = 0x00;
+        out[n++] = name_len;
+        memcpy(out + n, name, name_len);
+        n += name_len;
+    }
+    out[n++] = value_len;
+    memcpy(out + n, value, value_len);
+    return n + value_len;
+}
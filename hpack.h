@@ -0,0 +1,44 @@
+/*********************************************************************************
+* Daniel Choy
+* 2022 Spring
+* hpack.h
+* Header file for HPACK header compression ADT
+*********************************************************************************/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define HPACK_DEFAULT_TABLE_SIZE 4096
+
+typedef struct {
+    char *name;
+    size_t name_len;
+    char *value;
+    size_t value_len;
+} HpackEntry;
+
+// Dynamic table of a decoder. Entries are kept in a ring with the newest
+// entry at index first.
+typedef struct {
+    HpackEntry *entries;
+    int capacity;
+    int count;
+    int first;
+    size_t size;
+    size_t max_size;
+    size_t settings_max_size;
+} HpackTable;
+
+typedef void (*HpackEmit)(
+    void *ctx, const char *name, size_t name_len, const char *value, size_t value_len);
+
+HpackTable new_hpack_table(size_t max_size);
+
+void free_hpack_table(HpackTable *t);
+
+bool hpack_decode(HpackTable *t, const uint8_t *block, size_t len, HpackEmit emit, void *ctx);
+
+size_t hpack_encode(uint8_t *out, const char *name, const char *value);
@@ -5,14 +5,19 @@
 * Implementation file for httpserver.c
 *********************************************************************************/
 
+#define _GNU_SOURCE
+
+#include "h2.h"
 #include "queue.h"
 #include <pthread.h>
+#include <sched.h>
 #include <assert.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -22,13 +27,27 @@
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
 #include <netinet/in.h>
 #include <sys/types.h>
 #include <unistd.h>
 
-#define OPTIONS              "t:l:"
+#define OPTIONS              "t:l:a:u:w:"
 #define DEFAULT_THREAD_COUNT 4
 #define BLOCK                4096
+#define QUEUE_CAPACITY       4096
+#define MAX_NUMA_NODES       64
+#define WARM_URIS            128
+#define WARM_TRACKED         8192
+#define WARM_LOG_BYTES       (64L << 20)
+#define HANDOFF_TIMEOUT      10
+#define DRAIN_TIMEOUT        30
+
+#ifndef SO_INCOMING_CPU
+#define SO_INCOMING_CPU 49
+#endif
 
 static FILE *logfile;
 #define LOG(...) fprintf(logfile, __VA_ARGS__);
@@ -36,9 +55,43 @@ static FILE *logfile;
 pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t empty = PTHREAD_COND_INITIALIZER;
 pthread_cond_t full = PTHREAD_COND_INITIALIZER;
+pthread_cond_t idle = PTHREAD_COND_INITIALIZER;
 
 BoundedQueue q;
 
+// Connections that are queued or being handled, protected by lock
+static int active_connections = 0;
+
+// Set by SIGTERM and SIGINT. The read end of drain_pipe becomes readable at
+// the same time so threads blocked in poll() notice without a race.
+static volatile sig_atomic_t drain_signal = 0;
+static int drain_pipe[2];
+
+static int listenfd;
+static int handoff_fd = -1;
+
+typedef enum { AFFINITY_NONE, AFFINITY_CPU, AFFINITY_NUMA } AffinityMode;
+
+// A worker thread and the queue it takes connections from. Without affinity
+// every worker shares the global queue; with affinity each worker is pinned
+// and owns a queue that the dispatcher steers connections into. Pinned
+// workers also take connections from the global queue when theirs is empty.
+typedef struct {
+    BoundedQueue *q;
+    pthread_cond_t *full;
+    BoundedQueue local_q;
+    pthread_cond_t local_full;
+    cpu_set_t cpus;
+    int node;
+    bool busy;
+} Worker;
+
+static AffinityMode affinity = AFFINITY_NONE;
+static Worker *workers;
+static int num_workers;
+static int cpu_node[CPU_SETSIZE];
+static pthread_barrier_t workers_ready;
+
 // Converts a string to an 16 bits unsigned integer.
 // Returns 0 if the string is malformed or out of the range.
 static size_t strtouint16(char number[]) {
@@ -71,6 +124,436 @@ static int create_listen_socket(uint16_t port) {
     return listenfd;
 }
 
+static void handoff_address(struct sockaddr_un *addr, const char *path) {
+    memset(addr, 0, sizeof *addr);
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof addr->sun_path) {
+        errx(EXIT_FAILURE, "handoff socket path too long: %s", path);
+    }
+    strcpy(addr->sun_path, path);
+}
+
+// Connects to the handoff socket of a running server. The server keeps serving
+// until ack_handoff() is called. Returns -1 if no server is listening on path.
+static int connect_handoff(const char *path) {
+    struct sockaddr_un addr;
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        err(EXIT_FAILURE, "socket error");
+    }
+    handoff_address(&addr, path);
+    if (connect(sock, (struct sockaddr *) &addr, sizeof addr) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Receives the listen socket of the running server over its handoff socket
+// and checks that it listens on port. Closes the program and prints an error
+// message on error, which leaves the running server serving.
+static int receive_listen_socket(int sock, uint16_t port) {
+    char byte;
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof addr;
+    struct iovec iov = { &byte, 1 };
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    int fd = -1;
+
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof control.buf;
+    if (recvmsg(sock, &msg, 0) > 0) {
+        cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof fd);
+        }
+    }
+    if (fd < 0) {
+        errx(EXIT_FAILURE, "no listen socket received from running server");
+    }
+    if (getsockname(fd, (struct sockaddr *) &addr, &addr_len) < 0 || addr.sin_family != AF_INET
+        || ntohs(addr.sin_port) != port) {
+        errx(EXIT_FAILURE, "running server does not listen on port %u", port);
+    }
+    return fd;
+}
+
+// Tells the previous server that this one is accepting, so it can drain.
+static void ack_handoff(int sock) {
+    if (send(sock, "", 1, 0) != 1) {
+        warn("handoff ack failed");
+    }
+    close(sock);
+}
+
+// Binds the Unix socket at path that the next server process connects to.
+// It is bound at a temporary path and renamed over path, so the running
+// server's socket stays in place if this fails.
+static int create_handoff_socket(const char *path) {
+    struct sockaddr_un addr;
+    char temp_path[sizeof addr.sun_path + 16];
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        err(EXIT_FAILURE, "socket error");
+    }
+    snprintf(temp_path, sizeof temp_path, "%s.%d", path, (int) getpid());
+    handoff_address(&addr, temp_path);
+    unlink(temp_path);
+    if (bind(sock, (struct sockaddr *) &addr, sizeof addr) < 0) {
+        err(EXIT_FAILURE, "bind error");
+    }
+    if (listen(sock, 1) < 0 || rename(temp_path, path) < 0) {
+        unlink(temp_path);
+        err(EXIT_FAILURE, "cannot create handoff socket %s", path);
+    }
+    return sock;
+}
+
+static bool send_listen_socket(int sock) {
+    char byte = 0;
+    struct iovec iov = { &byte, 1 };
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+
+    memset(&msg, 0, sizeof msg);
+    memset(&control, 0, sizeof control);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof control.buf;
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &listenfd, sizeof listenfd);
+    return sendmsg(sock, &msg, 0) == 1;
+}
+
+// Hands the listen socket to a new server process that connects to the
+// handoff socket, and starts draining this one once the new process acks that
+// it is accepting. Both processes accept from the same socket until then, so
+// no connection is refused. If the new process goes away without acking,
+// this one keeps serving.
+static void *handoff_manager(void *arg) {
+    struct timeval timeout = { HANDOFF_TIMEOUT, 0 };
+    char ack;
+
+    (void) arg;
+    for (;;) {
+        int sock = accept(handoff_fd, NULL, NULL);
+        if (sock < 0) {
+            continue;
+        }
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+        if (!send_listen_socket(sock)) {
+            warn("handoff failed");
+        } else if (recv(sock, &ack, 1, 0) != 1) {
+            warnx("new server did not take over the listen socket, still serving");
+        } else {
+            close(sock);
+            break;
+        }
+        close(sock);
+    }
+
+    warnx("handed off listen socket");
+    close(handoff_fd);
+    kill(getpid(), SIGTERM);
+    return NULL;
+}
+
+typedef struct {
+    char *uri;
+    int hits;
+} UriCount;
+
+static int compare_hits(const void *a, const void *b) {
+    return ((const UriCount *) b)->hits - ((const UriCount *) a)->hits;
+}
+
+// Returns the slot of uri in a hash table of WARM_TRACKED slots: the slot
+// holding it, or the empty slot it would go in.
+static size_t find_uri(const UriCount *table, const char *uri) {
+    size_t h = 2166136261u;
+    for (const char *p = uri; *p != '\0'; p++) {
+        h = (h ^ (unsigned char) *p) * 16777619u;
+    }
+    h &= WARM_TRACKED - 1;
+    while (table[h].uri != NULL && strcmp(table[h].uri, uri) != 0) {
+        h = (h + 1) & (WARM_TRACKED - 1);
+    }
+    return h;
+}
+
+// Makes room in a full table by halving every hit count and dropping the URIs
+// left with none, which also favors URIs requested later in the log. Returns
+// the number of URIs left.
+static int decay_uris(UriCount *table) {
+    UriCount *kept = malloc(WARM_TRACKED * sizeof(UriCount));
+    int num_kept = 0;
+
+    for (int i = 0; i < WARM_TRACKED; i++) {
+        if (table[i].uri == NULL) {
+            continue;
+        } else if (table[i].hits / 2 == 0) {
+            free(table[i].uri);
+        } else {
+            kept[num_kept].uri = table[i].uri;
+            kept[num_kept++].hits = table[i].hits / 2;
+        }
+    }
+    memset(table, 0, WARM_TRACKED * sizeof(UriCount));
+    for (int i = 0; i < num_kept; i++) {
+        table[find_uri(table, kept[i].uri)] = kept[i];
+    }
+    free(kept);
+    return num_kept;
+}
+
+// Reads an audit log and asks the kernel to read the most requested files into
+// the page cache, so a restarted server does not start with a cold cache.
+// The log is appended to across restarts, so only its last WARM_LOG_BYTES are
+// read and at most WARM_TRACKED / 2 distinct URIs are counted at a time.
+static void prewarm_cache(const char *path) {
+    char line[BLOCK];
+    UriCount *counts;
+    int num_uris = 0;
+    int warmed = 0;
+    struct stat log_stats;
+
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        warn("cannot pre-warm from %s", path);
+        return;
+    }
+    if (fstat(fileno(f), &log_stats) == 0 && log_stats.st_size > WARM_LOG_BYTES) {
+        fseeko(f, log_stats.st_size - WARM_LOG_BYTES, SEEK_SET);
+        // Skipping the partial line the read starts in
+        if (fgets(line, sizeof line, f) == NULL) {
+            fclose(f);
+            return;
+        }
+    }
+
+    // Audit log lines have the form "method,uri,status,request_id"
+    counts = calloc(WARM_TRACKED, sizeof(UriCount));
+    while (fgets(line, sizeof line, f) != NULL) {
+        char *uri = strchr(line, ',');
+        char *end = uri != NULL ? strchr(uri + 1, ',') : NULL;
+        size_t slot;
+        if (end == NULL || (atoi(end + 1) != 200 && atoi(end + 1) != 201) || uri[1] != '/') {
+            continue;
+        }
+        *end = '\0';
+        slot = find_uri(counts, uri + 1);
+        if (counts[slot].uri != NULL) {
+            counts[slot].hits++;
+            continue;
+        }
+        if (num_uris == WARM_TRACKED / 2) {
+            num_uris = decay_uris(counts);
+            slot = find_uri(counts, uri + 1);
+        }
+        if (num_uris < WARM_TRACKED / 2) {
+            counts[slot].uri = strdup(uri + 1);
+            counts[slot].hits = 1;
+            num_uris++;
+        }
+    }
+    fclose(f);
+
+    // Empty slots have no hits and sort after the num_uris counted ones
+    qsort(counts, WARM_TRACKED, sizeof(UriCount), compare_hits);
+    for (int i = 0; i < num_uris && warmed < WARM_URIS; i++) {
+        int fd = open(counts[i].uri + 1, O_RDONLY);
+        if (fd < 0) {
+            continue;
+        }
+        if (posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED) == 0) {
+            warmed++;
+        }
+        close(fd);
+    }
+    warnx("pre-warmed %d files from %s", warmed, path);
+
+    for (int i = 0; i < num_uris; i++) {
+        free(counts[i].uri);
+    }
+    free(counts);
+}
+
+// Waits for the next request on a new or idle keep-alive connection.
+// Returns false if the server started draining first.
+static bool wait_for_request(int connfd) {
+    struct pollfd fds[2] = { { connfd, POLLIN, 0 }, { drain_pipe[0], POLLIN, 0 } };
+    if (poll(fds, 2, -1) < 0) {
+        return true;
+    }
+    return fds[0].revents != 0 || fds[1].revents == 0;
+}
+
+// Sends a response header. Responses sent while the server is draining ask
+// the client to close the connection.
+static void send_response(int connfd, const char *response) {
+    const char *headers = strstr(response, "\r\n") + 2;
+    if (drain_signal) {
+        send(connfd, response, headers - response, MSG_MORE);
+        send(connfd, "Connection: close\r\n", 19, MSG_MORE);
+        send(connfd, headers, strlen(headers), 0);
+    } else {
+        send(connfd, response, strlen(response), 0);
+    }
+}
+
+// Records which NUMA node each CPU belongs to by reading the node cpulists
+// from sysfs. CPUs are left on node 0 when the topology is not available.
+static void load_numa_topology(void) {
+    char path[64];
+    char list[BLOCK];
+
+    memset(cpu_node, 0, sizeof cpu_node);
+    for (int node = 0; node < MAX_NUMA_NODES; node++) {
+        snprintf(path, sizeof path, "/sys/devices/system/node/node%d/cpulist", node);
+        FILE *f = fopen(path, "r");
+        if (f == NULL) {
+            continue;
+        }
+        if (fgets(list, sizeof list, f) != NULL) {
+            // cpulist has the form "0-3,8-11"
+            char *p = list;
+            char *end;
+            while (*p != '\0') {
+                long lo = strtol(p, &end, 10);
+                long hi = lo;
+                if (end == p) {
+                    break;
+                }
+                if (*end == '-') {
+                    p = end + 1;
+                    hi = strtol(p, &end, 10);
+                }
+                for (long cpu = lo; cpu <= hi && cpu < CPU_SETSIZE; cpu++) {
+                    if (cpu >= 0) {
+                        cpu_node[cpu] = node;
+                    }
+                }
+                if (*end != ',') {
+                    break;
+                }
+                p = end + 1;
+            }
+        }
+        fclose(f);
+    }
+}
+
+// Chooses the CPUs each worker is pinned to. In CPU mode worker i gets the
+// i-th CPU the process may run on; in NUMA mode workers are spread over the
+// nodes and may run on any CPU of their node.
+static void place_workers(void) {
+    cpu_set_t allowed;
+    int cpus[CPU_SETSIZE];
+    int ncpus = 0;
+    int nodes[MAX_NUMA_NODES];
+    int nnodes = 0;
+
+    if (sched_getaffinity(0, sizeof allowed, &allowed) < 0) {
+        err(EXIT_FAILURE, "sched_getaffinity() failed");
+    }
+    load_numa_topology();
+
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed)) {
+            continue;
+        }
+        cpus[ncpus++] = cpu;
+
+        bool seen = false;
+        for (int i = 0; i < nnodes; i++) {
+            if (nodes[i] == cpu_node[cpu]) {
+                seen = true;
+                break;
+            }
+        }
+        if (!seen && nnodes < MAX_NUMA_NODES) {
+            nodes[nnodes++] = cpu_node[cpu];
+        }
+    }
+
+    for (int i = 0; i < num_workers; i++) {
+        Worker *w = &workers[i];
+        CPU_ZERO(&w->cpus);
+        if (affinity == AFFINITY_CPU) {
+            int cpu = cpus[i % ncpus];
+            CPU_SET(cpu, &w->cpus);
+            w->node = cpu_node[cpu];
+        } else {
+            w->node = nodes[i % nnodes];
+            for (int j = 0; j < ncpus; j++) {
+                if (cpu_node[cpus[j]] == w->node) {
+                    CPU_SET(cpus[j], &w->cpus);
+                }
+            }
+        }
+    }
+}
+
+// Returns the CPU whose softirq last processed packets for connfd, or -1.
+static int incoming_cpu(int connfd) {
+    int cpu = -1;
+    socklen_t len = sizeof cpu;
+    if (getsockopt(connfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) < 0 || cpu < 0
+        || cpu >= CPU_SETSIZE) {
+        return -1;
+    }
+    return cpu;
+}
+
+// Picks an idle worker for a connection received on cpu: one pinned to that
+// CPU, else one on the same NUMA node, else any. A worker keeps a connection
+// for its whole keep-alive lifetime, so busy workers are never picked.
+// Returns NULL when every worker is busy or connections are already waiting
+// on the global queue, in which case the connection goes on the global queue
+// behind them for the first worker that finishes.
+// Must be called with lock held.
+static Worker *steer_connection(int cpu) {
+    Worker *best = NULL;
+    int best_rank = 3;
+
+    if (affinity == AFFINITY_NONE || !empty_queue(&q)) {
+        return NULL;
+    }
+    for (int i = 0; i < num_workers; i++) {
+        Worker *w = &workers[i];
+        int rank = 2;
+        if (w->busy || !empty_queue(w->q)) {
+            continue;
+        }
+        if (cpu >= 0 && CPU_ISSET(cpu, &w->cpus)) {
+            rank = 0;
+        } else if (cpu >= 0 && w->node == cpu_node[cpu]) {
+            rank = 1;
+        }
+        if (rank < best_rank) {
+            best = w;
+            best_rank = rank;
+        }
+    }
+    return best;
+}
+
 static void handle_connection(int connfd) {
     char *buffer = malloc(sizeof(char) * BLOCK);
     char *temp;
@@ -94,12 +577,35 @@ static void handle_connection(int connfd) {
 
     memset(buffer, 0, curr_buff_size);
 
-    // Receiving request from client
+    // Receiving request from client, unless the server starts draining first
+    if (!wait_for_request(connfd)) {
+        free(buffer);
+        close(connfd);
+        return;
+    }
     current = recv(connfd, buffer, BLOCK, 0);
+
+    // A request cut short by the network may look like the start of the
+    // HTTP/2 preface, so keep reading until it either matches or differs
+    while (current > 0 && h2_is_partial_preface(buffer, current)) {
+        ssize_t more = recv(connfd, buffer + current, BLOCK - current, 0);
+        if (more <= 0) {
+            break;
+        }
+        current += more;
+    }
+
+    // Clients with prior knowledge of HTTP/2 start with the connection preface
+    if (current > 0 && h2_is_preface(buffer, current)) {
+        h2_serve(connfd, logfile, drain_pipe[0], buffer, current, NULL);
+        free(buffer);
+        close(connfd);
+        return;
+    }
     if (current == 0 || strstr(buffer, "HTTP/1.1") == NULL) {
         strcpy(
             method_buffer, "HTTP/1.1 400 Bad Request\r\nContent-Length: 12\r\n\r\nBad Request\n");
-        send(connfd, method_buffer, strlen(method_buffer), 0);
+        send_response(connfd, method_buffer);
         memset(buffer, 0, curr_buff_size);
         free(buffer);
         return;
@@ -134,7 +640,7 @@ static void handle_connection(int connfd) {
                 if (method == NULL) {
                     strcpy(method_buffer,
                         "HTTP/1.1 400 Bad Request\r\nContent-Length: 12\r\n\r\nBad Request\n");
-                    send(connfd, method_buffer, strlen(method_buffer), 0);
+                    send_response(connfd, method_buffer);
                     memset(buffer, 0, curr_buff_size);
                     free(temp);
                     free(buffer);
@@ -144,7 +650,7 @@ static void handle_connection(int connfd) {
                 if (uri == NULL || uri[0] != '/' || uri[strlen(uri) - 1] == '/') {
                     strcpy(method_buffer,
                         "HTTP/1.1 400 Bad Request\r\nContent-Length: 12\r\n\r\nBad Request\n");
-                    send(connfd, method_buffer, strlen(method_buffer), 0);
+                    send_response(connfd, method_buffer);
                     memset(buffer, 0, curr_buff_size);
                     free(temp);
                     free(buffer);
@@ -154,7 +660,7 @@ static void handle_connection(int connfd) {
                 if (version == NULL || (strcmp(version, "HTTP/1.1")) != 0) {
                     strcpy(method_buffer,
                         "HTTP/1.1 400 Bad Request\r\nContent-Length: 12\r\n\r\nBad Request\n");
-                    send(connfd, method_buffer, strlen(method_buffer), 0);
+                    send_response(connfd, method_buffer);
                     memset(buffer, 0, curr_buff_size);
                     free(temp);
                     free(buffer);
@@ -163,7 +669,7 @@ static void handle_connection(int connfd) {
             } else {
                 strcpy(method_buffer,
                     "HTTP/1.1 400 Bad Request\r\nContent-Length: 12\r\n\r\nBad Request\n");
-                send(connfd, method_buffer, strlen(method_buffer), 0);
+                send_response(connfd, method_buffer);
                 memset(buffer, 0, curr_buff_size);
                 free(temp);
                 free(buffer);
@@ -175,7 +681,7 @@ static void handle_connection(int connfd) {
                 && (strcmp(method, "APPEND")) != 0) {
                 strcpy(method_buffer,
                     "HTTP/1.1 501 Not Implemented\r\nContent-Length: 16\r\n\r\nNot Implemented\n");
-                send(connfd, method_buffer, strlen(method_buffer), 0);
+                send_response(connfd, method_buffer);
                 memset(buffer, 0, curr_buff_size);
                 free(temp);
                 free(buffer);
@@ -218,7 +724,7 @@ static void handle_connection(int connfd) {
                             if (errno == EACCES) {
                                 strcpy(method_buffer, "HTTP/1.1 403 Forbidden\r\nContent-Length: "
                                                       "10\r\n\r\nForbidden\n");
-                                send(connfd, method_buffer, strlen(method_buffer), 0);
+                                send_response(connfd, method_buffer);
                                 memset(buffer, 0, curr_buff_size);
                                 free(temp);
                                 free(buffer);
@@ -235,7 +741,7 @@ static void handle_connection(int connfd) {
                                     strcpy(method_buffer,
                                         "HTTP/1.1 403 Forbidden\r\nContent-Length: "
                                         "10\r\n\r\nForbidden\n");
-                                    send(connfd, method_buffer, strlen(method_buffer), 0);
+                                    send_response(connfd, method_buffer);
                                     memset(buffer, 0, curr_buff_size);
                                     free(temp);
                                     free(buffer);
@@ -280,7 +786,7 @@ static void handle_connection(int connfd) {
 
                                     strcpy(method_buffer, "HTTP/1.1 201 Created\r\nContent-Length: "
                                                           "8\r\n\r\nCreated\n");
-                                    send(connfd, method_buffer, strlen(method_buffer), 0);
+                                    send_response(connfd, method_buffer);
 
                                     // Logging Request
                                     LOG("%s,%s,201,%ld\n", method, uri, request_id);
@@ -319,7 +825,7 @@ static void handle_connection(int connfd) {
 
                             strcpy(
                                 method_buffer, "HTTP/1.1 200 OK\r\nContent-Length: 3\r\n\r\nOK\n");
-                            send(connfd, method_buffer, strlen(method_buffer), 0);
+                            send_response(connfd, method_buffer);
 
                             // Logging Request
                             LOG("%s,%s,200,%ld\n", method, uri, request_id);
@@ -333,7 +839,7 @@ static void handle_connection(int connfd) {
                         if (errno == ENOENT) {
                             strcpy(method_buffer, "HTTP/1.1 404 Not Found\r\nContent-Length: "
                                                   "10\r\n\r\nNot Found\n");
-                            send(connfd, method_buffer, strlen(method_buffer), 0);
+                            send_response(connfd, method_buffer);
                             memset(buffer, 0, curr_buff_size);
                             free(temp);
                             free(buffer);
@@ -346,7 +852,7 @@ static void handle_connection(int connfd) {
                         } else if (errno == EACCES) {
                             strcpy(method_buffer, "HTTP/1.1 403 Forbidden\r\nContent-Length: "
                                                   "10\r\n\r\nForbidden\n");
-                            send(connfd, method_buffer, strlen(method_buffer), 0);
+                            send_response(connfd, method_buffer);
                             memset(buffer, 0, curr_buff_size);
                             free(temp);
                             free(buffer);
@@ -362,7 +868,7 @@ static void handle_connection(int connfd) {
                             if (errno == EISDIR || (init && S_ISDIR(fd_stats.st_mode))) {
                                 strcpy(method_buffer, "HTTP/1.1 403 Forbidden\r\nContent-Length: "
                                                       "10\r\n\r\nForbidden\n");
-                                send(connfd, method_buffer, strlen(method_buffer), 0);
+                                send_response(connfd, method_buffer);
                                 memset(buffer, 0, curr_buff_size);
                                 free(temp);
                                 free(buffer);
@@ -404,7 +910,7 @@ static void handle_connection(int connfd) {
 
                                 strcpy(method_buffer,
                                     "HTTP/1.1 200 OK\r\nContent-Length: 3\r\n\r\nOK\n");
-                                send(connfd, method_buffer, strlen(method_buffer), 0);
+                                send_response(connfd, method_buffer);
 
                                 // Logging Request
                                 LOG("%s,%s,200,%ld\n", method, uri, request_id);
@@ -418,6 +924,8 @@ static void handle_connection(int connfd) {
                     char *next_header = strstr(headers_start, "\r\n");
                     size_t len = next_header - headers_start;
                     char *curr_header = NULL;
+                    bool upgrade_h2c = false;
+                    char *h2_settings = NULL;
 
                     while (len > 0) {
                         curr_header = strndup(headers_start, len);
@@ -426,6 +934,11 @@ static void handle_connection(int connfd) {
                             if (val != NULL) {
                                 request_id = atol(val + 1);
                             }
+                        } else if (strncasecmp("Upgrade:", curr_header, 8) == 0) {
+                            upgrade_h2c = strstr(curr_header + 8, "h2c") != NULL;
+                        } else if (strncasecmp("HTTP2-Settings:", curr_header, 15) == 0) {
+                            free(h2_settings);
+                            h2_settings = strdup(curr_header + 15 + strspn(curr_header + 15, " "));
                         }
 
                         free(curr_header);
@@ -437,13 +950,26 @@ static void handle_connection(int connfd) {
                         len = next_header - headers_start;
                     }
 
+                    // Switching to HTTP/2 with this request as stream 1
+                    if (upgrade_h2c && h2_settings != NULL) {
+                        H2Upgrade upgrade = { uri, request_id, h2_settings };
+                        h2_serve(connfd, logfile, drain_pipe[0], buffer + end_of_headers + 1,
+                            bytes - end_of_headers - 1, &upgrade);
+                        free(h2_settings);
+                        free(temp);
+                        free(buffer);
+                        close(connfd);
+                        return;
+                    }
+                    free(h2_settings);
+
                     // Handling GET method
                     fd = open(uri + 1, O_RDONLY);
 
                     if (errno == ENOENT) {
                         strcpy(method_buffer,
                             "HTTP/1.1 404 Not Found\r\nContent-Length: 10\r\n\r\nNot Found\n");
-                        send(connfd, method_buffer, strlen(method_buffer), 0);
+                        send_response(connfd, method_buffer);
 
                         // Logging Request
                         LOG("%s,%s,404,%ld\n", method, uri, request_id);
@@ -457,7 +983,7 @@ static void handle_connection(int connfd) {
                     } else if (errno == EACCES) {
                         strcpy(method_buffer,
                             "HTTP/1.1 403 Forbidden\r\nContent-Length: 10\r\n\r\nForbidden\n");
-                        send(connfd, method_buffer, strlen(method_buffer), 0);
+                        send_response(connfd, method_buffer);
 
                         // Logging Request
                         LOG("%s,%s,403,%ld\n", method, uri, request_id);
@@ -474,7 +1000,7 @@ static void handle_connection(int connfd) {
                         if (errno == EISDIR || (init && S_ISDIR(fd_stats.st_mode))) {
                             strcpy(method_buffer, "HTTP/1.1 403 Forbidden\r\nContent-Length: "
                                                   "10\r\n\r\nForbidden\n");
-                            send(connfd, method_buffer, strlen(method_buffer), 0);
+                            send_response(connfd, method_buffer);
 
                             // Logging Request
                             LOG("%s,%s,403,%ld\n", method, uri, request_id);
@@ -488,7 +1014,7 @@ static void handle_connection(int connfd) {
                         } else {
                             sprintf(method_buffer, "HTTP/1.1 200 OK\r\nContent-Length: %lu\r\n\r\n",
                                 fd_stats.st_size);
-                            send(connfd, method_buffer, strlen(method_buffer), 0);
+                            send_response(connfd, method_buffer);
 
                             // Getting message body from file and writing it to connfd
                             bytes = read(fd, method_buffer, BLOCK);
@@ -523,48 +1049,78 @@ static void handle_connection(int connfd) {
                 headers_found = false;
             }
         }
-        current = recv(connfd, buffer + bytes, curr_buff_size - bytes, 0);
+        // Closing idle connections once the server is draining, which also
+        // closes connections whose last response carried Connection: close
+        if (bytes == 0 && (drain_signal || !wait_for_request(connfd))) {
+            current = 0;
+        } else {
+            current = recv(connfd, buffer + bytes, curr_buff_size - bytes, 0);
+        }
         free(temp);
     }
     free(buffer);
     close(connfd);
 }
 
+// Starts draining: main() stops accepting and exits once in-flight
+// connections are finished.
 static void sigterm_handler(int sig) {
-    if (sig == SIGTERM) {
-        warnx("received SIGTERM");
-        free(q.buffer);
-        fclose(logfile);
-        exit(EXIT_SUCCESS);
-    } else if (sig == SIGINT) {
-        warnx("received SIGINT");
-        free(q.buffer);
-        fclose(logfile);
-        exit(EXIT_SUCCESS);
+    int saved_errno = errno;
+    if (sig == SIGTERM || sig == SIGINT) {
+        drain_signal = sig;
+        ssize_t written = write(drain_pipe[1], "", 1);
+        (void) written;
     }
+    errno = saved_errno;
 }
 
 static void usage(char *exec) {
-    fprintf(stderr, "usage: %s [-t threads] [-l logfile] <port>\n", exec);
+    fprintf(stderr,
+        "usage: %s [-t threads] [-l logfile] [-a cpu|numa] [-u handoff_socket] [-w audit_log] "
+        "<port>\n",
+        exec);
 }
 
 void *thread_manager(void *arg) {
-    BoundedQueue *q = (BoundedQueue *) arg;
+    Worker *w = (Worker *) arg;
 
     int connfd = 0;
 
+    if (affinity != AFFINITY_NONE) {
+        if (pthread_setaffinity_np(pthread_self(), sizeof w->cpus, &w->cpus) != 0) {
+            warnx("pthread_setaffinity_np() failed");
+        }
+
+        // Only idle workers are steered to, so the local queue holds at most
+        // one connection. Request buffers in handle_connection() are
+        // malloc()ed by this thread after pinning, so their pages come from
+        // the local node.
+        w->local_q = new_queue(1);
+        pthread_cond_init(&w->local_full, NULL);
+        w->q = &w->local_q;
+        w->full = &w->local_full;
+    }
+    pthread_barrier_wait(&workers_ready);
+
     while (1) {
         pthread_mutex_lock(&lock);
-        while (empty_queue(q)) {
-            pthread_cond_wait(&full, &lock);
+        while (empty_queue(w->q) && empty_queue(&q)) {
+            pthread_cond_wait(w->full, &lock);
         }
 
-        dequeue(q, &connfd);
+        dequeue(empty_queue(w->q) ? &q : w->q, &connfd);
+        w->busy = true;
 
         pthread_cond_signal(&empty);
         pthread_mutex_unlock(&lock);
 
         handle_connection(connfd);
+
+        pthread_mutex_lock(&lock);
+        active_connections--;
+        w->busy = false;
+        pthread_cond_signal(&idle);
+        pthread_mutex_unlock(&lock);
     }
 
     return NULL;
@@ -573,6 +1129,9 @@ void *thread_manager(void *arg) {
 int main(int argc, char *argv[]) {
     int opt = 0;
     int threads = DEFAULT_THREAD_COUNT;
+    char *logfile_path = NULL;
+    char *handoff_path = NULL;
+    char *warm_path = NULL;
     logfile = stderr;
 
     while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
@@ -583,10 +1142,16 @@ int main(int argc, char *argv[]) {
                 errx(EXIT_FAILURE, "bad number of threads");
             }
             break;
-        case 'l':
-            logfile = fopen(optarg, "w");
-            if (!logfile) {
-                errx(EXIT_FAILURE, "bad logfile");
+        case 'l': logfile_path = optarg; break;
+        case 'u': handoff_path = optarg; break;
+        case 'w': warm_path = optarg; break;
+        case 'a':
+            if (strcmp(optarg, "cpu") == 0) {
+                affinity = AFFINITY_CPU;
+            } else if (strcmp(optarg, "numa") == 0) {
+                affinity = AFFINITY_NUMA;
+            } else {
+                errx(EXIT_FAILURE, "bad affinity mode: %s", optarg);
             }
             break;
         default: usage(argv[0]); return EXIT_FAILURE;
@@ -604,38 +1169,147 @@ int main(int argc, char *argv[]) {
         errx(EXIT_FAILURE, "bad port number: %s", argv[1]);
     }
 
+    // sigterm_handler() only records the signal and writes to drain_pipe
+    struct sigaction sa;
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = sigterm_handler;
+    sigemptyset(&sa.sa_mask);
+    if (pipe(drain_pipe) < 0) {
+        err(EXIT_FAILURE, "pipe() failed");
+    }
     signal(SIGPIPE, SIG_IGN);
-    signal(SIGTERM, sigterm_handler);
-    signal(SIGINT, sigterm_handler);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
 
-    int listenfd = create_listen_socket(port);
+    // Pre-warming happens while the running server, if any, is still serving
+    if (warm_path != NULL) {
+        prewarm_cache(warm_path);
+    }
 
-    q = new_queue(4096);
+    // Everything that can fail is set up between connecting to the running
+    // server and acking the handoff, so a failed start leaves it serving
+    int handoff_sock = handoff_path != NULL ? connect_handoff(handoff_path) : -1;
+
+    // The previous process may still be logging while it drains, so the log
+    // is opened for appending and is not truncated after a takeover
+    if (logfile_path != NULL) {
+        int logfd = open(logfile_path,
+            O_WRONLY | O_CREAT | O_APPEND | (handoff_sock >= 0 ? 0 : O_TRUNC), 0644);
+        logfile = logfd >= 0 ? fdopen(logfd, "a") : NULL;
+        if (!logfile) {
+            errx(EXIT_FAILURE, "bad logfile");
+        }
+    }
+
+    q = new_queue(QUEUE_CAPACITY);
 
-    for (int i = 0; i < threads; i++) {
+    num_workers = threads;
+    workers = calloc(num_workers, sizeof(Worker));
+    for (int i = 0; i < num_workers; i++) {
+        workers[i].q = &q;
+        workers[i].full = &full;
+    }
+    if (affinity != AFFINITY_NONE) {
+        place_workers();
+    }
+
+    // Only the dispatcher handles SIGTERM and SIGINT, so the other threads
+    // never see EINTR in the middle of a request
+    sigset_t drain_signals;
+    sigemptyset(&drain_signals);
+    sigaddset(&drain_signals, SIGTERM);
+    sigaddset(&drain_signals, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &drain_signals, NULL);
+
+    pthread_barrier_init(&workers_ready, NULL, num_workers + 1);
+    for (int i = 0; i < num_workers; i++) {
         pthread_t p;
-        if (pthread_create(&p, NULL, thread_manager, &q) != 0) {
+        if (pthread_create(&p, NULL, thread_manager, &workers[i]) != 0) {
             err(EXIT_FAILURE, "pthread_create() failed");
         }
     }
+    pthread_barrier_wait(&workers_ready);
 
-    for (;;) {
+    if (handoff_sock >= 0) {
+        listenfd = receive_listen_socket(handoff_sock, port);
+    } else {
+        listenfd = create_listen_socket(port);
+    }
+    fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+
+    if (handoff_path != NULL) {
+        pthread_t p;
+        handoff_fd = create_handoff_socket(handoff_path);
+        if (pthread_create(&p, NULL, handoff_manager, NULL) != 0) {
+            err(EXIT_FAILURE, "pthread_create() failed");
+        }
+    }
+    if (handoff_sock >= 0) {
+        ack_handoff(handoff_sock);
+    }
+    pthread_sigmask(SIG_UNBLOCK, &drain_signals, NULL);
+
+    while (!drain_signal) {
+        struct pollfd fds[2] = { { listenfd, POLLIN, 0 }, { drain_pipe[0], POLLIN, 0 } };
+        if (poll(fds, 2, -1) < 0 || (fds[0].revents & POLLIN) == 0) {
+            continue;
+        }
+
+        // The listen socket is non-blocking because a new server process may
+        // be accepting from it too during a handoff
         int connfd = accept(listenfd, NULL, NULL);
         if (connfd < 0) {
-            warn("accept error");
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                warn("accept error");
+            }
             continue;
         }
 
+        // Hand the connection to a worker on the CPU that received it
+        int cpu = affinity != AFFINITY_NONE ? incoming_cpu(connfd) : -1;
+        Worker *w;
+
         pthread_mutex_lock(&lock);
-        while (full_queue(&q)) {
+        while ((w = steer_connection(cpu)) == NULL && full_queue(&q)) {
             pthread_cond_wait(&empty, &lock);
         }
 
-        enqueue(&q, connfd);
+        enqueue(w != NULL ? w->q : &q, connfd);
+        active_connections++;
 
-        pthread_cond_signal(&full);
+        if (w != NULL) {
+            pthread_cond_signal(w->full);
+        } else if (affinity == AFFINITY_NONE) {
+            pthread_cond_signal(&full);
+        } else {
+            // Only idle workers are waiting, any of them may take it
+            for (int i = 0; i < num_workers; i++) {
+                pthread_cond_signal(workers[i].full);
+            }
+        }
         pthread_mutex_unlock(&lock);
     }
 
+    warnx("received %s, draining connections", drain_signal == SIGINT ? "SIGINT" : "SIGTERM");
+    close(listenfd);
+
+    // Connections that are still open after DRAIN_TIMEOUT seconds, such as
+    // clients that stopped sending in the middle of a request, are closed
+    // when the process exits
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += DRAIN_TIMEOUT;
+    pthread_mutex_lock(&lock);
+    while (active_connections > 0) {
+        if (pthread_cond_timedwait(&idle, &lock, &deadline) == ETIMEDOUT) {
+            warnx("closing %d connections after drain timeout", active_connections);
+            pthread_mutex_unlock(&lock);
+            return EXIT_FAILURE;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+
+    free(q.buffer);
+    fclose(logfile);
     return EXIT_SUCCESS;
 }